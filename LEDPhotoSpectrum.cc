@@ -6,6 +6,10 @@
 
 #include <iostream>
 #include <fstream>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+#include <sstream>
 #include <serial.h>
 #include <boost/program_options.hpp>
 #include <data.h>
@@ -14,6 +18,8 @@
 
 #include "lpm.h"
 #include "cfg.h"
+#include "library.h"
+#include "planner.h"
 
 int main(int argc, char **argv) {
 
@@ -21,9 +27,13 @@ int main(int argc, char **argv) {
 
     std::string arduinoDevFile;
     std::string pr655DevFile;
+    std::string libraryPath = "data/library";
+    std::string rig = lpm::default_rig();
+    std::string warmupFile = "data/warmup.yml";
 
     bool pictureFlag =  true;
     bool spectrumFlag =  true;
+    bool learnFlag =  false;
 
     device::pr655 meter;
 
@@ -32,6 +42,10 @@ int main(int argc, char **argv) {
             ("help",    "Supported Arguments/Flags")
             ("arduino", po::value<std::string>(&arduinoDevFile), "Device file for Aurdrino")
             ("pr655", po::value<std::string>(&pr655DevFile), "Device file for pr655 Spectrometer")
+            ("library", po::value<std::string>(&libraryPath), "Spectral library directory (default: data/library)")
+            ("rig", po::value<std::string>(&rig), "Rig name stored with the spectra, at most 16 bytes (default: host name)")
+            ("warmup", po::value<std::string>(&warmupFile), "Learned LED warm-up constants (default: data/warmup.yml)")
+            ("learn", "Sample the warm-up of every LED with the spectrometer and update the warm-up constants")
             ("c",    "Specify this flag to skip capturing of photographs from camera")
             ("s",    "Specify this flag to skip measurement of spectrometer");
 
@@ -39,6 +53,11 @@ int main(int argc, char **argv) {
     po::store(po::command_line_parser(argc, argv).options(opts).run(), vm);
     po::notify(vm);
 
+    if(rig.size() > lpm::rig_max) {
+        std::cout << "Error: rig name is longer than " << lpm::rig_max << " bytes" << std::endl;
+        return -1;
+    }
+
     if(vm.count("c")) {
         pictureFlag = false;
     }
@@ -47,6 +66,10 @@ int main(int argc, char **argv) {
         spectrumFlag = false;
     }
 
+    if(vm.count("learn")) {
+        learnFlag = true;
+    }
+
     if(vm.count("help")) {
         std::cout << opts << std::endl;
         return 0;
@@ -83,27 +106,121 @@ int main(int argc, char **argv) {
             std::cout << "pin: " << unsigned(elem.first) << "  --  Wavelength: " << unsigned(elem.second) << "nm \n";
         }
 
+        /*
+         * order the LEDs by heat load and predict their warm-up times
+         */
+        std::unique_ptr<lpm::planner> planner;
+        try {
+            planner.reset(new lpm::planner(warmupFile));
+        } catch (const std::exception &e) {
+            std::cout << "Error: Could not load warm-up constants from " << warmupFile << ": " << e.what() << std::endl;
+            return -1;
+        }
+        const std::vector<lpm::sweep_step> steps = planner->plan(ledMap, ledPwmMap);
+
+        std::ofstream sweepLog("data/sweep.log", std::ios::app);
+        time_t sweepStart = time(nullptr);
+        sweepLog << "sweep " << ctime(&sweepStart);
+
+        std::cout << "Planned order: " << std::endl;
+        for(auto step : steps)    {
+            std::cout << "pin: " << unsigned(step.pin) << "  --  Wavelength: " << unsigned(step.wavelength) << "nm  --  PWM: " << step.pwm << "  --  predicted warm-up: " << step.settle << "s \n";
+            sweepLog << "  plan pin " << unsigned(step.pin) << " " << step.wavelength << "nm pwm " << step.pwm << " settle " << step.settle << "s" << std::endl;
+        }
+
         std::cout << std::endl << "Starting Process for all available LEDs..." << std::endl << std::endl;
 
         std::map<uint16_t, spectral_data> spectrumData;
         std::ofstream errorOut("data/error.txt");
+        std::chrono::steady_clock::time_point sweepBegin = std::chrono::steady_clock::now();
 
-        for(auto elem : ledMap)    {
+        /*
+         * every measured spectrum is also appended to the spectral library
+         */
+        std::unique_ptr<lpm::library> library;
+        if(spectrumFlag) {
+            try {
+                library.reset(new lpm::library(libraryPath));
+            } catch (const std::exception &e) {
+                std::cout << "Error: " << e.what() << std::endl;
+                return -1;
+            }
+        }
 
-            std::cout << "$: Turning on " << unsigned(elem.second) << "nm LED on pin " << unsigned(elem.first) << " with PWM: " << ledPwmMap.at(elem.second) <<std::endl;
+        for(auto step : steps)    {
+
+            std::cout << "$: Turning on " << unsigned(step.wavelength) << "nm LED on pin " << unsigned(step.pin) << " with PWM: " << step.pwm <<std::endl;
             /*
              * Turn on LED
              */
-            lpm.led(elem.first, ledPwmMap.at(elem.second));
+            std::string response;
+            try {
+                response = lpm.led(step.pin, step.pwm);
+            } catch (const device::command_error &e) {
+                std::cerr << e.what() << std::endl;
+                errorOut << ">>: Unable to turn on " << unsigned(step.wavelength) << "nm LED on pin " << unsigned(step.pin) << ": " << e.what() << std::endl;
+
+                // make sure the LED is off before skipping it
+                try {
+                    lpm.reset();
+                } catch (const device::command_error &err) {
+                    std::cerr << err.what() << std::endl;
+                }
+                continue;
+            }
             std::cout << "---------------------------------------" << std::endl;
             std::cout  << "From arduino after turning LED on: " << std::endl;
-            lpm.receiveArduinoOutput();    //print stream from arduino
+            std::cout << response;
             std::cout << "---------------------------------------" << std::endl << std::endl << std::endl ;
 
-            /*
-             * Time delay of 1 sec
-             */
-            usleep(1000000);
+            std::chrono::steady_clock::time_point ledOn = std::chrono::steady_clock::now();
+
+            if(spectrumFlag && learnFlag) {
+
+                /*
+                 * Sample the peak of the spectrum until the LED has warmed up
+                 */
+                std::cout << "$: Sampling warm-up" << std::endl;
+
+                for(int i = 0; i < 10 && !planner->settled(step.wavelength); i++) {
+                    try {
+                        if (meter.start()) {
+                            meter.units(true);
+                            bool could_measure = meter.measure();
+                            spectral_data data = meter.spectral();
+                            if (could_measure && !data.data.empty()) {
+                                float peak = *std::max_element(data.data.begin(), data.data.end());
+                                double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - ledOn).count();
+                                planner->observe(step.wavelength, t, peak);
+                                std::cout << "t: " << t << "s  --  Peak at: " << peak << std::endl;
+                            }
+                        }
+                    } catch (const std::exception &e) {
+                        std::cerr << e.what() << std::endl;
+                    }
+
+                    meter.stop();
+                }
+
+                // finish() returns -1 if the series could not be fitted
+                double actual = planner->finish(step.wavelength, step.pwm);
+                std::stringstream actualText;
+                if (actual < 0) {
+                    actualText << "n/a";
+                } else {
+                    actualText << actual << "s";
+                }
+                std::cout << "$: Warm-up predicted: " << step.settle << "s  --  actual: " << actualText.str() << std::endl;
+                sweepLog << "  pin " << unsigned(step.pin) << " " << step.wavelength << "nm predicted " << step.settle << "s actual " << actualText.str() << std::endl;
+
+            } else {
+
+                /*
+                 * Wait until the LED output is predicted to be stable
+                 */
+                usleep(static_cast<useconds_t>(step.settle * 1000000));
+                sweepLog << "  pin " << unsigned(step.pin) << " " << step.wavelength << "nm predicted " << step.settle << "s actual n/a" << std::endl;
+            }
 
             if(pictureFlag) {
 
@@ -111,10 +228,16 @@ int main(int argc, char **argv) {
                  * Take the picture
                  */
                 std::cout << "$: Capturing Photograph from Camera" << std::endl;
-                lpm.shoot();
+                response.clear();
+                try {
+                    response = lpm.shoot();
+                } catch (const device::command_error &e) {
+                    std::cerr << e.what() << std::endl;
+                    errorOut << ">>: Unable to take picture of " << unsigned(step.wavelength) << "nm LED on pin " << unsigned(step.pin) << ": " << e.what() << std::endl;
+                }
                 std::cout << "---------------------------------------" << std::endl;
                 std::cout  << "From arduino after taking picture " << std::endl;
-                lpm.receiveArduinoOutput();    //print stream from arduino
+                std::cout << response;
                 std::cout << "---------------------------------------" << std::endl << std::endl << std::endl ;
 
                 /*
@@ -145,10 +268,19 @@ int main(int argc, char **argv) {
                     device::pr655::cfg config = meter.config();
                     spectral_data data = meter.spectral();
                     if(could_measure) {
-                        spectrumData.insert( std::pair<uint16_t , spectral_data>(elem.second, data) );
+                        spectrumData.insert( std::pair<uint16_t , spectral_data>(step.wavelength, data) );
+
+                        lpm::spectrum entry;
+                        entry.rig = rig;
+                        entry.pin = step.pin;
+                        entry.wavelength = step.wavelength;
+                        entry.pwm = step.pwm;
+                        entry.timestamp = time(nullptr);
+                        lpm::set_spectral(entry, data);
+                        library->add(entry);
                     } else {
-                        std::cout << ">>: Unable to measure spectrum of " << unsigned(elem.second) << "nm LED on pin " << unsigned(elem.first) << " with PWM: " << ledPwmMap.at(elem.second) <<std::endl;
-                        errorOut << ">>: Unable to measure spectrum of " << unsigned(elem.second) << "nm LED on pin " << unsigned(elem.first) << " with PWM: " << ledPwmMap.at(elem.second) <<std::endl;
+                        std::cout << ">>: Unable to measure spectrum of " << unsigned(step.wavelength) << "nm LED on pin " << unsigned(step.pin) << " with PWM: " << step.pwm <<std::endl;
+                        errorOut << ">>: Unable to measure spectrum of " << unsigned(step.wavelength) << "nm LED on pin " << unsigned(step.pin) << " with PWM: " << step.pwm <<std::endl;
                     }
 
                 } catch (const std::exception &e) {
@@ -167,10 +299,16 @@ int main(int argc, char **argv) {
              * Reset the LED
              */
             std::cout << "$: Resetting the LED" << std::endl;
-            lpm.reset();
+            try {
+                response = lpm.reset();
+            } catch (const device::command_error &e) {
+                response.clear();
+                std::cerr << e.what() << std::endl;
+                errorOut << ">>: Unable to reset " << unsigned(step.wavelength) << "nm LED on pin " << unsigned(step.pin) << ": " << e.what() << std::endl;
+            }
             std::cout << "---------------------------------------" << std::endl;
             std::cout  << "From arduino after resetting" << std::endl;
-            lpm.receiveArduinoOutput();    //print stream from arduino
+            std::cout << response;
             std::cout << "---------------------------------------" << std::endl << std::endl << std::endl ;
 
             /*
@@ -179,6 +317,16 @@ int main(int argc, char **argv) {
             usleep(1000000);
         }
 
+        double sweepTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - sweepBegin).count();
+        std::cout << "Sweep time: " << sweepTime << "s" << std::endl;
+        sweepLog << "  total " << sweepTime << "s" << std::endl;
+
+        if(learnFlag) {
+            planner->save();
+        }
+
+        std::cout << "Arduino link: " << lpm.health << std::endl;
+
         if(spectrumFlag) {
 
             std::ofstream fout("data/spectral.txt");
@@ -221,6 +369,15 @@ int main(int argc, char **argv) {
             fout.close();
         }
 
+        if(library) {
+            try {
+                library->flush();
+            } catch (const std::exception &e) {
+                std::cout << "Error: " << e.what() << std::endl;
+                return -1;
+            }
+        }
+
     } else {
         std::cout << "Not Enough Arguments. call --help for help" << std::endl;
     }
@@ -4,6 +4,8 @@
  */
 #include <iostream>
 #include <fstream>
+#include <chrono>
+#include <memory>
 #include <serial.h>
 #include <math.h>
 #include <boost/program_options.hpp>
@@ -13,6 +15,8 @@
 
 #include "lpm.h"
 #include "cfg.h"
+#include "library.h"
+#include "planner.h"
 
 int main(int argc, char **argv) {
 
@@ -20,17 +24,28 @@ int main(int argc, char **argv) {
 
     std::string arduinoDevFile;
     std::string pr655DevFile;
+    std::string libraryPath = "data/library";
+    std::string rig = lpm::default_rig();
+    std::string warmupFile = "data/warmup.yml";
 
     po::options_description opts("IRIS LED PWM Thresholder");
     opts.add_options()
             ("help",    "Call --help for help")
             ("arduino", po::value<std::string>(&arduinoDevFile), "Device file for Aurdrino")
-            ("pr655", po::value<std::string>(&pr655DevFile), "Device file for pr655 Spectrometer");
+            ("pr655", po::value<std::string>(&pr655DevFile), "Device file for pr655 Spectrometer")
+            ("library", po::value<std::string>(&libraryPath), "Spectral library directory (default: data/library)")
+            ("rig", po::value<std::string>(&rig), "Rig name stored with the spectra, at most 16 bytes (default: host name)")
+            ("warmup", po::value<std::string>(&warmupFile), "Learned LED warm-up constants (default: data/warmup.yml)");
 
     po::variables_map vm;
     po::store(po::command_line_parser(argc, argv).options(opts).run(), vm);
     po::notify(vm);
 
+    if(rig.size() > lpm::rig_max) {
+        std::cout << "Error: rig name is longer than " << lpm::rig_max << " bytes" << std::endl;
+        return -1;
+    }
+
     if(vm.count("help")) {
         std::cout << opts << std::endl << std::endl;
         return 0;
@@ -54,45 +69,93 @@ int main(int argc, char **argv) {
             std::cout << "pin: " << unsigned(elem.first) << "  --  Wavelength: " << unsigned(elem.second) << "nm \n";
         }
 
+        /*
+         * every LED starts at full power, so the order only depends on the
+         * wavelength and the predicted warm-up times (learned by
+         * lpm-LEDPhotoSpectrum --learn)
+         */
+        std::unique_ptr<const lpm::planner> planner;
+        try {
+            planner.reset(new lpm::planner(warmupFile));
+        } catch (const std::exception &e) {
+            std::cout << "Error: Could not load warm-up constants from " << warmupFile << ": " << e.what() << std::endl;
+            return -1;
+        }
+        const std::vector<lpm::sweep_step> steps = planner->plan(ledMap, std::map<uint16_t, uint16_t>());
+
+        std::ofstream sweepLog("data/sweep.log", std::ios::app);
+        time_t sweepStart = time(nullptr);
+        sweepLog << "threshold sweep " << ctime(&sweepStart);
+
+        std::cout << "Planned order: " << std::endl;
+        for(auto step : steps)    {
+            std::cout << "pin: " << unsigned(step.pin) << "  --  Wavelength: " << unsigned(step.wavelength) << "nm  --  predicted warm-up: " << step.settle << "s \n";
+            sweepLog << "  plan pin " << unsigned(step.pin) << " " << step.wavelength << "nm pwm " << step.pwm << " settle " << step.settle << "s" << std::endl;
+        }
+
         std::cout << std::endl << "Starting Thresholding Process for all available LEDs..." << std::endl << std::endl;
 
         std::map<uint16_t, spectral_data> spectrumData;
+        std::ofstream errorOut("data/error.txt");
 
         std::map<uint16_t, uint16_t> led_pin_pwm;
 
+        /*
+         * the final spectrum of every LED goes into the spectral library
+         */
+        std::unique_ptr<lpm::library> library;
+        try {
+            library.reset(new lpm::library(libraryPath));
+        } catch (const std::exception &e) {
+            std::cout << "Error: " << e.what() << std::endl;
+            return -1;
+        }
+
         float threshold = 0.000025;
         bool thresholdFlag = false;
 
         int pwmDecrementStepSize = 500;
         uint16_t previousPWMVal = 4096;  //initially 4096
 
+        std::chrono::steady_clock::time_point sweepBegin = std::chrono::steady_clock::now();
+
         while(!thresholdFlag) {
 
-            for(auto elem : ledMap)    {
+            for(auto step : steps)    {
 
-                std::cout << "$: Turning on " << unsigned(elem.second) << "nm LED on pin " << unsigned(elem.first) << std::endl;
+                std::cout << "$: Turning on " << unsigned(step.wavelength) << "nm LED on pin " << unsigned(step.pin) << std::endl;
 
                 bool currentLedThresholdFlag = false;
 
                 while(!currentLedThresholdFlag) {
 
-                    std::string pwmCmd = "pwm " + std::to_string(unsigned(elem.first)) + "," + std::to_string(previousPWMVal) + "";
+                    std::string pwmCmd = "pwm " + std::to_string(unsigned(step.pin)) + "," + std::to_string(previousPWMVal) + "";
 
                     std::cout << "executing: " << pwmCmd << std::endl;
 
                     /*
                      * Turn on LED
                      */
-                    lpm.led(elem.first, previousPWMVal);
+                    std::string response;
+                    try {
+                        response = lpm.led(step.pin, previousPWMVal);
+                    } catch (const device::command_error &e) {
+                        // skip this LED, it is reset below
+                        std::cerr << e.what() << std::endl;
+                        errorOut << ">>: Unable to turn on " << unsigned(step.wavelength) << "nm LED on pin " << unsigned(step.pin) << " with PWM: " << previousPWMVal << ": " << e.what() << std::endl;
+                        previousPWMVal = 4096;
+                        break;
+                    }
                     std::cout << "---------------------------------------" << std::endl;
                     std::cout  << "From arduino after turning LED on: " << std::endl;
-                    lpm.receiveArduinoOutput();    //print stream from arduino
+                    std::cout << response;
                     std::cout << "---------------------------------------" << std::endl << std::endl << std::endl ;
 
                     /*
-                     * Time delay of 1 sec
+                     * Wait until the LED output is predicted to be stable
+                     * at the current PWM
                      */
-                    usleep(1000000);
+                    usleep(static_cast<useconds_t>(planner->predict(step.wavelength, previousPWMVal) * 1000000));
 
                     /*
                      * Measure the Spectrum
@@ -127,13 +190,22 @@ int main(int argc, char **argv) {
 
                         if( diff  < 0.000005 || previousPWMVal < 1000) {        // it's ok now if diff is less than specified value or PWM gets lower than 1000
                             currentLedThresholdFlag = true;
-                            led_pin_pwm.insert(std::pair<uint16_t, uint16_t>(elem.second, previousPWMVal));
-                            spectrumData.insert( std::pair<uint16_t , spectral_data>(elem.second, data) );
+                            led_pin_pwm.insert(std::pair<uint16_t, uint16_t>(step.wavelength, previousPWMVal));
+                            spectrumData.insert( std::pair<uint16_t , spectral_data>(step.wavelength, data) );
+
+                            lpm::spectrum entry;
+                            entry.rig = rig;
+                            entry.pin = step.pin;
+                            entry.wavelength = step.wavelength;
+                            entry.pwm = previousPWMVal;
+                            entry.timestamp = time(nullptr);
+                            lpm::set_spectral(entry, data);
+                            library->add(entry);
                             previousPWMVal = 4096;
                         } else {
                             previousPWMVal = previousPWMVal - pwmDecrementStepSize;
                         }
-                        spectrumData.insert( std::pair<uint16_t , spectral_data>(elem.second, data) );
+                        spectrumData.insert( std::pair<uint16_t , spectral_data>(step.wavelength, data) );
 
                     } catch (const std::exception &e) {
                         std::cerr << e.what() << std::endl;
@@ -146,10 +218,16 @@ int main(int argc, char **argv) {
                  * Reset the LED
                  */
                 std::cout << "$: Resetting the LED" << std::endl;
-                lpm.reset();
+                std::string response;
+                try {
+                    response = lpm.reset();
+                } catch (const device::command_error &e) {
+                    std::cerr << e.what() << std::endl;
+                    errorOut << ">>: Unable to reset " << unsigned(step.wavelength) << "nm LED on pin " << unsigned(step.pin) << ": " << e.what() << std::endl;
+                }
                 std::cout << "---------------------------------------" << std::endl;
                 std::cout  << "From arduino after resetting" << std::endl;
-                lpm.receiveArduinoOutput();    //print stream from arduino
+                std::cout << response;
                 std::cout << "---------------------------------------" << std::endl << std::endl << std::endl ;
 
                 /*
@@ -162,6 +240,12 @@ int main(int argc, char **argv) {
             thresholdFlag = true;   //all pwm values are good now
         }
 
+        double sweepTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - sweepBegin).count();
+        std::cout << "Sweep time: " << sweepTime << "s" << std::endl;
+        sweepLog << "  total " << sweepTime << "s" << std::endl;
+
+        std::cout << "Arduino link: " << lpm.health << std::endl;
+
 
         std::ofstream pwmout("data/pwm.txt");
 
@@ -206,6 +290,14 @@ int main(int argc, char **argv) {
         }
 
         fout.close();
+        errorOut.close();
+
+        try {
+            library->flush();
+        } catch (const std::exception &e) {
+            std::cout << "Error: " << e.what() << std::endl;
+            return -1;
+        }
 
     } else {
         std::cout << "Not Enough Arguments. call --help for help" << std::endl;
@@ -0,0 +1,806 @@
+//
+// Spectral library storage
+//
+// <base>/seg-NNNNNN.dat  append-only, each record is a record header
+//                        followed by n floats of spectral data
+// <base>/index.dat       base index: index header, the sorted entries and
+//                        the size of every segment it covers
+// <base>/delta.dat       runs appended by flush(): run header, the sorted
+//                        entries added since the previous run and the
+//                        segment sizes covered after it
+//
+
+#include "library.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace lpm {
+
+static const uint32_t record_magic = 0x53504d4c; // "LPMS"
+static const uint32_t index_magic  = 0x49504d4c; // "LPMI"
+static const uint32_t run_magic    = 0x44504d4c; // "LPMD"
+static const uint32_t index_version = 2;
+static const uint64_t segment_limit = 64 * 1024 * 1024;
+
+// the delta is merged into the base index once it holds more than
+// this many entries, or more than 1/16th of the base index
+static const size_t delta_limit = 16384;
+
+struct record {
+    uint32_t magic;
+    uint16_t wavelength;
+    uint16_t pwm;
+    uint16_t n;
+    uint8_t  pin;
+    uint8_t  pad;
+    uint32_t reserved;
+    char     rig[16];
+    int64_t  timestamp;
+    float    wl_start;
+    float    wl_step;
+};
+
+struct index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t segments;      // number of segment sizes after the entries
+    uint32_t generation;    // delta runs of other generations are stale
+    uint64_t count;
+    uint64_t reserved;
+};
+
+struct run_header {
+    uint32_t magic;
+    uint32_t generation;
+    uint32_t segments;
+    uint32_t checksum;      // of the entries and segment sizes
+    uint64_t count;
+    uint64_t reserved;
+};
+
+static_assert(sizeof(record) == 48, "unexpected record layout");
+static_assert(sizeof(index_header) == 32, "unexpected index header layout");
+static_assert(sizeof(run_header) == 32, "unexpected run header layout");
+static_assert(sizeof(library::entry) == 40, "unexpected index entry layout");
+
+static std::runtime_error sys_error(const std::string &what) {
+    return std::runtime_error(what + ": " + strerror(errno));
+}
+
+// FNV-1a
+static uint32_t checksum(const uint8_t *data, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ data[i]) * 16777619u;
+    }
+    return h;
+}
+
+static int rig_cmp(const char *a, const char *b) {
+    return strncmp(a, b, 16);
+}
+
+static bool entry_less(const library::entry &a, const library::entry &b) {
+    int r = rig_cmp(a.rig, b.rig);
+    if (r != 0) {
+        return r < 0;
+    }
+
+    if (a.pin != b.pin) {
+        return a.pin < b.pin;
+    } else if (a.wavelength != b.wavelength) {
+        return a.wavelength < b.wavelength;
+    } else if (a.pwm != b.pwm) {
+        return a.pwm < b.pwm;
+    }
+
+    return a.timestamp < b.timestamp;
+}
+
+// level 1..3: pin, wavelength, pwm; level 4: timestamp
+static int64_t field(const library::entry &e, int level) {
+    switch (level) {
+    case 1: return e.pin;
+    case 2: return e.wavelength;
+    case 3: return e.pwm;
+    default: return e.timestamp;
+    }
+}
+
+static int64_t field(const query &q, int level) {
+    switch (level) {
+    case 1: return q.pin;
+    case 2: return q.wavelength;
+    default: return q.pwm;
+    }
+}
+
+static void copy_rig(char *dest, const std::string &rig) {
+    memset(dest, 0, 16);
+    memcpy(dest, rig.data(), std::min<size_t>(rig.size(), 16));
+}
+
+typedef const library::entry *entry_iter;
+
+// Walk a sorted range level by level: bound fields narrow the range
+// by binary search, unbound fields are skipped group by group so that
+// e.g. a wavelength lookup without a pin costs one search per pin.
+template<typename Fn>
+static void walk(entry_iter lo, entry_iter hi, int level, const query &q, bool last_only, Fn &fn) {
+
+    if (lo == hi) {
+        return;
+    }
+
+    if (level == 0) {
+        if (q.rig.empty()) {
+            while (lo != hi) {
+                const char *rig = lo->rig;
+                entry_iter next = std::upper_bound(lo, hi, *lo, [rig](const library::entry &, const library::entry &e) {
+                    return rig_cmp(rig, e.rig) < 0;
+                });
+                walk(lo, next, 1, q, last_only, fn);
+                lo = next;
+            }
+        } else {
+            if (q.rig.size() > rig_max) {
+                return;
+            }
+
+            library::entry key;
+            copy_rig(key.rig, q.rig);
+            auto r = std::equal_range(lo, hi, key, [](const library::entry &a, const library::entry &b) {
+                return rig_cmp(a.rig, b.rig) < 0;
+            });
+            walk(r.first, r.second, 1, q, last_only, fn);
+        }
+        return;
+    }
+
+    if (level == 4) {
+        entry_iter first = std::lower_bound(lo, hi, q.from, [](const library::entry &e, int64_t ts) {
+            return e.timestamp < ts;
+        });
+        entry_iter last = std::upper_bound(first, hi, q.to, [](int64_t ts, const library::entry &e) {
+            return ts < e.timestamp;
+        });
+
+        if (first == last) {
+            return;
+        } else if (last_only) {
+            fn(*(last - 1));
+            return;
+        }
+
+        std::for_each(first, last, fn);
+        return;
+    }
+
+    int64_t want = field(q, level);
+    auto less = [level](const library::entry &a, const library::entry &b) {
+        return field(a, level) < field(b, level);
+    };
+
+    if (want >= 0) {
+        // values outside of the field's range can not match anything
+        if (want > (level == 1 ? UINT8_MAX : UINT16_MAX)) {
+            return;
+        }
+
+        library::entry key;
+        memset(&key, 0, sizeof(key));
+        key.pin = level == 1 ? static_cast<uint8_t>(want) : 0;
+        key.wavelength = level == 2 ? static_cast<uint16_t>(want) : 0;
+        key.pwm = level == 3 ? static_cast<uint16_t>(want) : 0;
+        auto r = std::equal_range(lo, hi, key, less);
+        walk(r.first, r.second, level + 1, q, last_only, fn);
+        return;
+    }
+
+    while (lo != hi) {
+        entry_iter next = std::upper_bound(lo, hi, *lo, less);
+        walk(lo, next, level + 1, q, last_only, fn);
+        lo = next;
+    }
+}
+
+std::string default_rig() {
+    char name[256];
+    if (gethostname(name, sizeof(name)) != 0) {
+        return "unknown";
+    }
+    name[sizeof(name) - 1] = '\0';
+
+    std::string rig(name);
+    rig = rig.substr(0, rig.find('.'));
+
+    if (rig.size() > rig_max) {
+        fprintf(stderr, "[W] library: host name %s is longer than %zu bytes, using %s as rig\n",
+                name, rig_max, rig.substr(0, rig_max).c_str());
+        rig.resize(rig_max);
+    }
+
+    return rig;
+}
+
+library::library(const std::string &path, mode m) : base(path), access_mode(m), lock_fd(-1),
+                                                     base_map(nullptr), base_len(0), base_entries(nullptr),
+                                                     base_count(0), generation(0), dirty(false), rebuild(false) {
+
+    if (access_mode == mode::read_write) {
+        if (mkdir(base.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw sys_error("Could not create library " + base);
+        }
+
+        std::string lock = base + "/lock";
+        lock_fd = open(lock.c_str(), O_RDWR | O_CREAT, 0644);
+        if (lock_fd < 0) {
+            throw sys_error("Could not open " + lock);
+        }
+
+        if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+            int err = errno;
+            close(lock_fd);
+            errno = err;
+            throw sys_error("Library " + base + " is in use by another writer");
+        }
+    }
+
+    load_index();
+
+    if (segments.empty() && access_mode == mode::read_write) {
+        open_segment(0);
+    }
+
+    merge_pending();
+}
+
+library::~library() {
+    if (access_mode == mode::read_write) {
+        try {
+            flush();
+        } catch (const std::exception &e) {
+            fprintf(stderr, "[E] library: %s\n", e.what());
+        }
+    }
+
+    for (segment &seg : segments) {
+        if (seg.map != nullptr) {
+            munmap(seg.map, seg.mapped);
+        }
+        close(seg.fd);
+    }
+
+    drop_base();
+
+    if (lock_fd >= 0) {
+        close(lock_fd);
+    }
+}
+
+std::string library::segment_path(size_t n) const {
+    char name[32];
+    snprintf(name, sizeof(name), "/seg-%06zu.dat", n);
+    return base + name;
+}
+
+void library::open_segment(size_t n) {
+    std::string path = segment_path(n);
+    int flags = access_mode == mode::read_write ? O_RDWR | O_CREAT | O_APPEND : O_RDONLY;
+    int fd = open(path.c_str(), flags, 0644);
+
+    if (fd < 0) {
+        throw sys_error("Could not open segment " + path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw sys_error("Could not stat segment " + path);
+    }
+
+    segment seg = {fd, static_cast<uint64_t>(st.st_size), nullptr, 0};
+    segments.push_back(seg);
+}
+
+void library::load_index() {
+    // bytes of every segment covered by the base index and delta runs
+    std::vector<uint64_t> covered;
+
+    if (!load_base(covered)) {
+        covered.clear();
+        rebuild = true;
+    }
+    load_delta(covered);
+
+    for (size_t n = 0; ; n++) {
+        if (n >= covered.size() && access(segment_path(n).c_str(), F_OK) != 0) {
+            break;
+        }
+        open_segment(n);
+    }
+
+    // an index that covers more than is on disk (segments deleted or
+    // cut short) can not be trusted, rebuild it from the segments
+    bool fits = covered.size() <= segments.size();
+    for (size_t n = 0; fits && n < covered.size(); n++) {
+        fits = covered[n] <= segments[n].size;
+    }
+
+    if (!fits || rebuild) {
+        fprintf(stderr, "[W] library: index does not match the segments, rebuilding it\n");
+        drop_base();
+        delta.clear();
+        covered.clear();
+        rebuild = true;
+    }
+
+    // the index may be stale if a sweep was interrupted before flush();
+    // pick up whatever was appended after the indexed part
+    for (size_t n = 0; n < segments.size(); n++) {
+        scan(static_cast<uint16_t>(n), n < covered.size() ? covered[n] : 0);
+    }
+}
+
+// map index.dat; false if it exists but is not a valid index
+bool library::load_base(std::vector<uint64_t> &covered) {
+    std::string path = base + "/index.dat";
+    int fd = open(path.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return errno == ENOENT;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(index_header)) {
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    const index_header *hdr = static_cast<const index_header *>(map);
+    const uint8_t *body = static_cast<const uint8_t *>(map) + sizeof(index_header);
+    uint64_t size = static_cast<uint64_t>(st.st_size) - sizeof(index_header);
+
+    if (hdr->magic != index_magic || hdr->version != index_version ||
+        hdr->count > size / sizeof(entry) ||
+        hdr->count * sizeof(entry) + uint64_t(hdr->segments) * sizeof(uint64_t) != size) {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    base_map = map;
+    base_len = st.st_size;
+    base_entries = reinterpret_cast<const entry *>(body);
+    base_count = hdr->count;
+    generation = hdr->generation;
+
+    covered.resize(hdr->segments);
+    memcpy(covered.data(), body + hdr->count * sizeof(entry), hdr->segments * sizeof(uint64_t));
+    return true;
+}
+
+// read the delta runs of the base index's generation; the segment sizes
+// of the last one replace those of the base index. A torn run at the
+// end (interrupted flush) is cut off by writers and ignored by readers.
+void library::load_delta(std::vector<uint64_t> &covered) {
+    std::string path = base + "/delta.dat";
+    FILE *fd = fopen(path.c_str(), "rb");
+
+    if (fd == nullptr) {
+        return;
+    }
+
+    std::vector<uint8_t> buf;
+    uint8_t chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fd)) > 0) {
+        buf.insert(buf.end(), chunk, chunk + n);
+    }
+    fclose(fd);
+
+    // with a broken base index the runs are useless, but the rebuilt
+    // one has to get a generation none of them has
+    uint32_t newest = generation;
+
+    size_t offset = 0;
+    while (offset + sizeof(run_header) <= buf.size()) {
+        run_header hdr;
+        memcpy(&hdr, buf.data() + offset, sizeof(hdr));
+
+        uint64_t avail = buf.size() - offset - sizeof(hdr);
+        if (hdr.magic != run_magic || hdr.count > avail / sizeof(entry) ||
+            hdr.count * sizeof(entry) + uint64_t(hdr.segments) * sizeof(uint64_t) > avail) {
+            break;
+        }
+
+        const uint8_t *body = buf.data() + offset + sizeof(hdr);
+        size_t len = hdr.count * sizeof(entry) + hdr.segments * sizeof(uint64_t);
+        if (checksum(body, len) != hdr.checksum) {
+            break;
+        }
+
+        if (hdr.generation == generation && !rebuild) {
+            const entry *e = reinterpret_cast<const entry *>(body);
+            delta.insert(delta.end(), e, e + hdr.count);
+
+            covered.resize(hdr.segments);
+            memcpy(covered.data(), body + hdr.count * sizeof(entry), hdr.segments * sizeof(uint64_t));
+        }
+
+        newest = std::max(newest, hdr.generation);
+        offset += sizeof(hdr) + len;
+    }
+
+    if (rebuild) {
+        generation = newest;
+    }
+
+    // every run is sorted, their concatenation mostly so
+    std::sort(delta.begin(), delta.end(), entry_less);
+
+    if (offset < buf.size() && access_mode == mode::read_write) {
+        fprintf(stderr, "[W] library: truncating delta index at %zu\n", offset);
+        if (truncate(path.c_str(), offset) != 0) {
+            throw sys_error("Could not truncate " + path);
+        }
+    }
+}
+
+void library::drop_base() {
+    if (base_map != nullptr) {
+        munmap(base_map, base_len);
+    }
+
+    base_map = nullptr;
+    base_len = 0;
+    base_entries = nullptr;
+    base_count = 0;
+}
+
+// index the records of a segment starting at offset from; a torn
+// record at the end (interrupted write) is cut off by writers and
+// ignored by readers, for whom it may just be an append in progress
+void library::scan(uint16_t seg, uint64_t from) {
+    segment &s = segments[seg];
+    uint64_t offset = from;
+
+    while (offset + sizeof(record) <= s.size) {
+        record rec;
+        if (pread(s.fd, &rec, sizeof(rec), offset) != sizeof(rec) || rec.magic != record_magic) {
+            break;
+        }
+
+        uint64_t len = sizeof(record) + rec.n * sizeof(float);
+        if (offset + len > s.size) {
+            break;
+        }
+
+        entry e;
+        memset(&e, 0, sizeof(e));
+        memcpy(e.rig, rec.rig, sizeof(e.rig));
+        e.pin = rec.pin;
+        e.wavelength = rec.wavelength;
+        e.pwm = rec.pwm;
+        e.segment = seg;
+        e.timestamp = rec.timestamp;
+        e.offset = offset;
+        pending.push_back(e);
+        dirty = true;
+
+        offset += len;
+    }
+
+    if (offset < s.size && access_mode == mode::read_only) {
+        s.size = offset;
+    } else if (offset < s.size) {
+        fprintf(stderr, "[W] library: truncating segment %u at %llu\n",
+                unsigned(seg), static_cast<unsigned long long>(offset));
+        if (ftruncate(s.fd, offset) != 0) {
+            throw sys_error("Could not truncate segment");
+        }
+        s.size = offset;
+    }
+}
+
+void library::add(const spectrum &s) {
+
+    if (access_mode != mode::read_write) {
+        throw std::logic_error("library is opened read only");
+    } else if (s.rig.size() > rig_max) {
+        throw std::invalid_argument("rig name \"" + s.rig + "\" is longer than " + std::to_string(rig_max) + " bytes");
+    } else if (s.data.size() > UINT16_MAX) {
+        throw std::invalid_argument("spectrum has too many samples");
+    }
+
+    uint64_t len = sizeof(record) + s.data.size() * sizeof(float);
+    if (segments.back().size > 0 && segments.back().size + len > segment_limit) {
+        open_segment(segments.size());
+    }
+
+    record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = record_magic;
+    rec.wavelength = s.wavelength;
+    rec.pwm = s.pwm;
+    rec.n = static_cast<uint16_t>(s.data.size());
+    rec.pin = s.pin;
+    copy_rig(rec.rig, s.rig);
+    rec.timestamp = s.timestamp;
+    rec.wl_start = s.wl_start;
+    rec.wl_step = s.wl_step;
+
+    std::vector<uint8_t> buf(len);
+    memcpy(buf.data(), &rec, sizeof(rec));
+    memcpy(buf.data() + sizeof(rec), s.data.data(), s.data.size() * sizeof(float));
+
+    segment &seg = segments.back();
+    ssize_t n = write(seg.fd, buf.data(), buf.size());
+    if (n != static_cast<ssize_t>(len)) {
+        throw sys_error("Could not append to segment");
+    }
+
+    entry e;
+    memset(&e, 0, sizeof(e));
+    memcpy(e.rig, rec.rig, sizeof(e.rig));
+    e.pin = rec.pin;
+    e.wavelength = rec.wavelength;
+    e.pwm = rec.pwm;
+    e.segment = static_cast<uint16_t>(segments.size() - 1);
+    e.timestamp = rec.timestamp;
+    e.offset = seg.size;
+    pending.push_back(e);
+    dirty = true;
+
+    seg.size += len;
+}
+
+static void merge_into(std::vector<library::entry> &sorted, const std::vector<library::entry> &add) {
+    size_t mid = sorted.size();
+    sorted.insert(sorted.end(), add.begin(), add.end());
+    std::inplace_merge(sorted.begin(), sorted.begin() + mid, sorted.end(), entry_less);
+}
+
+void library::merge_pending() {
+    if (pending.empty()) {
+        return;
+    }
+
+    std::sort(pending.begin(), pending.end(), entry_less);
+
+    merge_into(delta, pending);
+    if (access_mode == mode::read_write) {
+        merge_into(unflushed, pending);
+    }
+    pending.clear();
+}
+
+void library::flush() {
+    if ((!dirty && !rebuild) || access_mode != mode::read_write) {
+        return;
+    }
+
+    merge_pending();
+
+    // only segments that got records since the last flush need a sync
+    size_t first = segments.size();
+    for (const entry &e : unflushed) {
+        first = std::min<size_t>(first, e.segment);
+    }
+    for (size_t n = first; n < segments.size(); n++) {
+        fdatasync(segments[n].fd);
+    }
+
+    if (rebuild || delta.size() > std::max(delta_limit, base_count / 16)) {
+        compact();
+    } else {
+        append_delta();
+    }
+
+    unflushed.clear();
+    dirty = false;
+    rebuild = false;
+}
+
+void library::append_delta() {
+    run_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = run_magic;
+    hdr.generation = generation;
+    hdr.segments = static_cast<uint32_t>(segments.size());
+    hdr.count = unflushed.size();
+
+    size_t len = unflushed.size() * sizeof(entry) + segments.size() * sizeof(uint64_t);
+    std::vector<uint8_t> buf(sizeof(hdr) + len);
+    uint8_t *body = buf.data() + sizeof(hdr);
+
+    if (!unflushed.empty()) {
+        memcpy(body, unflushed.data(), unflushed.size() * sizeof(entry));
+    }
+    for (size_t n = 0; n < segments.size(); n++) {
+        memcpy(body + unflushed.size() * sizeof(entry) + n * sizeof(uint64_t), &segments[n].size, sizeof(uint64_t));
+    }
+
+    hdr.checksum = checksum(body, len);
+    memcpy(buf.data(), &hdr, sizeof(hdr));
+
+    std::string path = base + "/delta.dat";
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        throw sys_error("Could not open " + path);
+    }
+
+    bool ok = write(fd, buf.data(), buf.size()) == static_cast<ssize_t>(buf.size());
+    ok = fdatasync(fd) == 0 && ok;
+    close(fd);
+
+    if (!ok) {
+        throw sys_error("Could not append to " + path);
+    }
+}
+
+// write base and delta as a new base index of the next generation
+void library::compact() {
+    std::vector<entry> merged(base_count + delta.size());
+    std::merge(base_entries, base_entries + base_count, delta.begin(), delta.end(), merged.begin(), entry_less);
+
+    index_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = index_magic;
+    hdr.version = index_version;
+    hdr.segments = static_cast<uint32_t>(segments.size());
+    hdr.generation = generation + 1;
+    hdr.count = merged.size();
+
+    std::vector<uint64_t> covered;
+    for (const segment &seg : segments) {
+        covered.push_back(seg.size);
+    }
+
+    std::string path = base + "/index.dat";
+    std::string tmp = path + ".tmp";
+    FILE *fd = fopen(tmp.c_str(), "wb");
+
+    if (fd == nullptr) {
+        throw sys_error("Could not write index " + tmp);
+    }
+
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, fd) == 1 &&
+              (merged.empty() || fwrite(merged.data(), sizeof(entry), merged.size(), fd) == merged.size()) &&
+              fwrite(covered.data(), sizeof(uint64_t), covered.size(), fd) == covered.size();
+    ok = fflush(fd) == 0 && ok;
+    ok = fdatasync(fileno(fd)) == 0 && ok;
+    fclose(fd);
+
+    // empty the delta first: if we stop in between, the old base index
+    // without its delta is merely stale and gets caught up by a scan
+    std::string delta_path = base + "/delta.dat";
+    if (!ok || (truncate(delta_path.c_str(), 0) != 0 && errno != ENOENT) ||
+        rename(tmp.c_str(), path.c_str()) != 0) {
+        throw sys_error("Could not write index " + path);
+    }
+
+    drop_base();
+    delta.clear();
+    if (!load_base(covered)) {
+        throw std::runtime_error("library: could not load the index just written to " + path);
+    }
+}
+
+const uint8_t *library::at(const entry &e) {
+    if (e.segment >= segments.size()) {
+        throw std::runtime_error("library: index refers to missing segment " + std::to_string(e.segment));
+    }
+
+    segment &seg = segments[e.segment];
+
+    if (e.offset + sizeof(record) > seg.size) {
+        throw std::runtime_error("library: index refers past the end of segment " + std::to_string(e.segment));
+    }
+
+    // records are only ever appended, so a mapping covers every record
+    // that was complete when it was made
+    if (e.offset >= seg.mapped) {
+        if (seg.map != nullptr) {
+            munmap(seg.map, seg.mapped);
+        }
+
+        void *map = mmap(nullptr, seg.size, PROT_READ, MAP_SHARED, seg.fd, 0);
+        if (map == MAP_FAILED) {
+            seg.map = nullptr;
+            seg.mapped = 0;
+            throw sys_error("Could not map segment");
+        }
+
+        seg.map = map;
+        seg.mapped = seg.size;
+    }
+
+    return static_cast<const uint8_t *>(seg.map) + e.offset;
+}
+
+spectrum library::read(const entry &e) {
+    const uint8_t *ptr = at(e);
+
+    record rec;
+    memcpy(&rec, ptr, sizeof(rec));
+
+    if (rec.magic != record_magic ||
+        e.offset + sizeof(record) + rec.n * sizeof(float) > segments[e.segment].size) {
+        throw std::runtime_error("library: broken record in segment " + std::to_string(e.segment));
+    }
+
+    spectrum s;
+    s.rig = std::string(rec.rig, strnlen(rec.rig, sizeof(rec.rig)));
+    s.pin = rec.pin;
+    s.wavelength = rec.wavelength;
+    s.pwm = rec.pwm;
+    s.timestamp = rec.timestamp;
+    s.wl_start = rec.wl_start;
+    s.wl_step = rec.wl_step;
+    s.data.resize(rec.n);
+    memcpy(s.data.data(), ptr + sizeof(rec), rec.n * sizeof(float));
+
+    return s;
+}
+
+std::vector<spectrum> library::find(const query &q) {
+    merge_pending();
+
+    std::vector<entry> hits;
+    auto collect = [&hits](const entry &e) {
+        hits.push_back(e);
+    };
+    walk(base_entries, base_entries + base_count, 0, q, false, collect);
+    size_t mid = hits.size();
+    walk(delta.data(), delta.data() + delta.size(), 0, q, false, collect);
+    std::inplace_merge(hits.begin(), hits.begin() + mid, hits.end(), entry_less);
+
+    std::vector<spectrum> result;
+    result.reserve(hits.size());
+    for (const entry &e : hits) {
+        result.push_back(read(e));
+    }
+
+    return result;
+}
+
+bool library::latest(const query &q, spectrum &out) {
+    bool found = false;
+    entry best;
+
+    auto pick = [&found, &best](const entry &e) {
+        if (!found || e.timestamp > best.timestamp) {
+            best = e;
+            found = true;
+        }
+    };
+
+    merge_pending();
+    walk(base_entries, base_entries + base_count, 0, q, true, pick);
+    walk(delta.data(), delta.data() + delta.size(), 0, q, true, pick);
+
+    if (found) {
+        out = read(best);
+    }
+
+    return found;
+}
+
+} // lpm::
@@ -0,0 +1,145 @@
+//
+// Persistent spectral library: every sweep appends its spectra to
+// segment files, a sorted index on (rig, pin, wavelength, pwm, timestamp)
+// allows lookups without scanning the segments.
+//
+
+#ifndef LPM_LIBRARY_H
+#define LPM_LIBRARY_H
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+
+namespace lpm {
+
+struct spectrum {
+    std::string rig;
+    uint8_t     pin;
+    uint16_t    wavelength;
+    uint16_t    pwm;
+    int64_t     timestamp;
+
+    float              wl_start;
+    float              wl_step;
+    std::vector<float> data;
+};
+
+// copy the spectral part of a pr655 measurement (spectral_data)
+template<typename T>
+void set_spectral(spectrum &s, const T &data) {
+    s.wl_start = data.wl_start;
+    s.wl_step = data.wl_step;
+    s.data.assign(data.data.begin(), data.data.end());
+}
+
+// rig names are stored in a fixed 16 byte field
+static const size_t rig_max = 16;
+
+// name of the rig when none is given: the host name without domain,
+// cut to rig_max
+std::string default_rig();
+
+// all fields are optional, unset fields match everything
+struct query {
+    query() : pin(-1), wavelength(-1), pwm(-1),
+              from(INT64_MIN), to(INT64_MAX) { }
+
+    std::string rig;
+    int         pin;
+    int         wavelength;
+    int         pwm;
+    int64_t     from;
+    int64_t     to;
+};
+
+class library {
+public:
+    // on-disk index record; the index file is a sorted array of these
+    struct entry {
+        char     rig[16];
+        uint8_t  pin;
+        uint8_t  pad;
+        uint16_t wavelength;
+        uint16_t pwm;
+        uint16_t segment;
+        int64_t  timestamp;
+        uint64_t offset;
+    };
+
+    enum class mode {
+        read_only,      // queries only, never modifies the library
+        read_write      // exclusive; fails if another writer has it open
+    };
+
+    explicit library(const std::string &path, mode m = mode::read_write);
+    ~library();
+
+    library(const library &) = delete;
+    library &operator=(const library &) = delete;
+
+    // append a spectrum to the current segment; it is visible to
+    // queries immediately and persisted in the index on flush();
+    // throws std::invalid_argument for rig names longer than rig_max
+    void add(const spectrum &s);
+
+    // persist the entries added since the last flush as a sorted delta
+    // run; once the delta grows large it is merged into the base index
+    void flush();
+
+    // all matching spectra, ordered by (rig, pin, wavelength, pwm, timestamp)
+    std::vector<spectrum> find(const query &q);
+
+    // most recent matching spectrum; returns false if there is none
+    bool latest(const query &q, spectrum &out);
+
+    size_t size() const { return base_count + delta.size() + pending.size(); }
+
+private:
+    struct segment {
+        int      fd;
+        uint64_t size;
+        void    *map;
+        uint64_t mapped;
+    };
+
+    std::string segment_path(size_t n) const;
+    void open_segment(size_t n);
+    void load_index();
+    bool load_base(std::vector<uint64_t> &covered);
+    void load_delta(std::vector<uint64_t> &covered);
+    void drop_base();
+    void scan(uint16_t seg, uint64_t from);
+    void merge_pending();
+    void append_delta();
+    void compact();
+    const uint8_t *at(const entry &e);
+    spectrum read(const entry &e);
+
+    std::string base;
+    mode access_mode;
+    int lock_fd;
+    std::vector<segment> segments;
+
+    // base index: sorted entries of index.dat, mapped read only
+    void        *base_map;
+    size_t       base_len;
+    const entry *base_entries;
+    size_t       base_count;
+    uint32_t     generation;
+
+    // sorted entries of the delta runs plus everything merged since
+    std::vector<entry> delta;
+    // sorted entries not yet written to a delta run
+    std::vector<entry> unflushed;
+    // unsorted entries added since the last query
+    std::vector<entry> pending;
+
+    bool dirty;
+    bool rebuild;
+};
+
+} // lpm::
+
+#endif //LPM_LIBRARY_H
@@ -34,8 +34,8 @@ cmd_pwm(device::lpm &lpm, const std::vector<std::string> &args)
     po::variables_map vm;
     po::store(po::command_line_parser(args).options(pwm_opts).run(), vm);
 
-    std::cerr << "[D] led: " << pin << " pwm: " <<  pwm << std::endl;
-    lpm.led(pin, pwm);
+    std::cerr << "[D] led: " << unsigned(pin) << " pwm: " <<  pwm << std::endl;
+    std::cout << lpm.led(pin, pwm);
     return 0;
 }
 
@@ -91,24 +91,31 @@ int main(int argc, char **argv) {
 
     device::lpm lpm = device::lpm::open(device);
 
-    if (input == "pwm") {
-        cmd_pwm(lpm, args);
-    } else if(input == "info") {
-        lpm.getInfo();
-    } else if(input == "reset") {
-        lpm.reset();
-    } else if(input == "shoot") {
-        lpm.shoot();
-    } else if (input == "raw") {
-        std::stringstream data;
-        std::copy(args.cbegin(), args.cend(), std::ostream_iterator<std::string>(data, " "));
-        std::cerr << "[D] [" << data.str() << "]" << std::endl;
-        std::string response = lpm.send_and_receive(data.str());
-        std::cout << "[R] [" << response << "]" << std::endl;
-    } else {
-        std::cout <<"[E] Unkown command! " << std::endl;
-        return -1;
+    try {
+        if (input == "pwm") {
+            cmd_pwm(lpm, args);
+        } else if(input == "info") {
+            std::cout << lpm.getInfo();
+        } else if(input == "reset") {
+            std::cout << lpm.reset();
+        } else if(input == "shoot") {
+            std::cout << lpm.shoot();
+        } else if (input == "raw") {
+            std::stringstream data;
+            std::copy(args.cbegin(), args.cend(), std::ostream_iterator<std::string>(data, " "));
+            std::cerr << "[D] [" << data.str() << "]" << std::endl;
+            std::string response = lpm.send_and_receive(data.str());
+            std::cout << "[R] [" << response << "]" << std::endl;
+        } else {
+            std::cout <<"[E] Unkown command! " << std::endl;
+            return -1;
+        }
+    } catch (const device::command_error &e) {
+        std::cerr << "[E] " << e.what() << std::endl;
+        return 1;
     }
 
+    std::cerr << "[D] Link: " << lpm.health << std::endl;
+
     return 0;
 }
\ No newline at end of file
@@ -1,14 +1,120 @@
 #include <serial.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
 
 namespace device {
 
+    enum class idempotency {
+        idempotent,     // may be resent, e.g. pwm, reset, info
+        once            // has side effects, e.g. shoot
+    };
+
+    class command_error : public std::runtime_error {
+    public:
+        command_error(const std::string &what) : std::runtime_error(what) { }
+    };
+
+    // no response line within the read timeout
+    class timeout_error : public std::runtime_error {
+    public:
+        timeout_error(const std::string &what) : std::runtime_error(what) { }
+    };
+
+    // Round-trip time of one command, used to derive its read timeout
+    // from what the link actually does.
+    struct rtt_estimate {
+        double rtt = 0;         // EWMA of the round-trip time [ms]
+        double rtt_var = 0;     // EWMA of the round-trip time deviation [ms]
+        uint64_t samples = 0;
+        int backoff = 1;        // timeout multiplier, doubled on every timeout
+
+        void sample(double ms) {
+            if (samples == 0) {
+                rtt = ms;
+                rtt_var = ms / 2;
+            } else {
+                rtt_var = 0.75 * rtt_var + 0.25 * std::fabs(ms - rtt);
+                rtt = 0.875 * rtt + 0.125 * ms;
+            }
+            samples++;
+            backoff = 1;
+        }
+
+        // the link got slower than the estimate: wait longer until a
+        // clean exchange gives a new sample
+        void timed_out() {
+            backoff = std::min(64, 2 * backoff);
+        }
+
+        // per line read timeout [ms]; 1s until there are samples. The
+        // estimate is kept within 200 ms and 5 s, backing off may go
+        // beyond that, the deadline of the command still applies.
+        int timeout() const {
+            double t = samples == 0 ? 1000 : std::min(5000.0, std::max(200.0, rtt + 4 * rtt_var));
+            return static_cast<int>(std::min(60000.0, t * backoff));
+        }
+    };
+
+    // Health of the link to the arduino: error rate over all commands,
+    // round-trip times per command (pwm answers a lot faster than shoot,
+    // so they must not share a timeout).
+    struct link_health {
+        std::map<std::string, rtt_estimate> rtt;
+        double error_rate = 0;  // EWMA of failed exchanges
+        uint64_t commands = 0;
+        uint64_t failures = 0;
+        uint64_t retries = 0;
+
+        // only a response to a command sent once is a round-trip time
+        // sample; after a resend it may be the answer to either (Karn)
+        void success(const std::string &cmd, double ms, bool resent) {
+            if (!resent) {
+                rtt[cmd].sample(ms);
+            }
+            commands++;
+            error_rate = 0.9 * error_rate;
+        }
+
+        void failure(const std::string &cmd, bool timed_out) {
+            if (timed_out) {
+                rtt[cmd].timed_out();
+            }
+            commands++;
+            failures++;
+            error_rate = 0.9 * error_rate + 0.1;
+        }
+
+        int timeout(const std::string &cmd) const {
+            auto it = rtt.find(cmd);
+            return it != rtt.end() ? it->second.timeout() : rtt_estimate().timeout();
+        }
+    };
+
+    inline std::ostream &operator<<(std::ostream &out, const link_health &health) {
+        for (auto elem : health.rtt) {
+            out << elem.first << " rtt: " << elem.second.rtt << " ms (+/- " << elem.second.rtt_var << "), ";
+        }
+        out << "error rate: " << health.error_rate
+            << ", commands: " << health.commands << ", failures: " << health.failures
+            << ", retries: " << health.retries;
+        return out;
+    }
+
 
     class lpm {
 
     public:
 
         device::serial io;
+        link_health health;
 
         lpm(const device::serial &io) : io(io) { }
 
@@ -17,39 +123,97 @@ namespace device {
             return lpm;
         }
 
-        void led(uint8_t pin, uint16_t pwm) {
+        std::string led(uint8_t pin, uint16_t pwm) {
             std::stringstream cmd;
-            cmd << "pwm " << pin << "," << pwm;
-            io.send_data(cmd.str());
-        }
-
-        void setPWM(std::string cmd) {
-            io.send_data(cmd);
+            cmd << "pwm " << unsigned(pin) << "," << pwm;
+            return execute(cmd.str(), idempotency::idempotent);
         }
 
         std::string getInfo() {
-            std::string info = send_and_receive("info");
+            std::string info = execute("info", idempotency::idempotent);
             return info;
         }
 
-        void reset() {
-            send_and_receive("reset");
+        std::string reset() {
+            return execute("reset", idempotency::idempotent);
+        }
+
+        // triggers the camera, so it is never repeated
+        std::string shoot() {
+            return execute("shoot", idempotency::once);
+        }
+
+        std::string send_and_receive(const std::string &data, int deadline = default_deadline) {
+            return execute(data, idempotency::once, deadline);
         }
 
-        void shoot() {
-            send_and_receive("shoot");
+        // Send a command and collect its response up to the terminator.
+        // The whole exchange, including retries, has to finish within
+        // deadline ms; idempotent commands are resent after a resync of
+        // the stream when a response is lost or garbled. Every timeout
+        // doubles the read timeout of the command.
+        std::string execute(const std::string &data, idempotency kind, int deadline = default_deadline) {
+            clock::time_point end = clock::now() + std::chrono::milliseconds(deadline);
+            const int attempts = kind == idempotency::idempotent ? 1 + max_retries : 1;
+            const std::string name = data.substr(0, data.find(' '));
+
+            for (int attempt = 1; ; attempt++) {
+                clock::time_point start = clock::now();
+
+                try {
+                    io.send_data(data);
+                    std::string response = read_response(name, end);
+                    health.success(name, std::chrono::duration<double, std::milli>(clock::now() - start).count(),
+                                   attempt > 1);
+                    return response;
+                } catch (const std::exception &e) {
+                    health.failure(name, dynamic_cast<const timeout_error *>(&e) != nullptr);
+
+                    if (attempt >= attempts || clock::now() >= end) {
+                        throw command_error("\"" + data + "\" failed after " + std::to_string(attempt) +
+                                            " attempt(s): " + e.what());
+                    }
+
+                    std::cerr << "[W] \"" << data << "\": " << e.what() << ", retrying" << std::endl;
+                    health.retries++;
+                    resync(name, end);
+                }
+            }
         }
 
-        std::string send_and_receive(const std::string &data) {
-            io.send_data(data);
+    private:
+        typedef std::chrono::steady_clock clock;
+
+        static const int default_deadline = 5000;
+        static const int max_retries = 2;
 
+        int line_timeout(const std::string &cmd, clock::time_point end) const {
+            long remaining = std::chrono::duration_cast<std::chrono::milliseconds>(end - clock::now()).count();
+            return static_cast<int>(std::max(1L, std::min<long>(remaining, health.timeout(cmd))));
+        }
+
+        std::string read_response(const std::string &cmd, clock::time_point end) {
             std::stringstream response;
 
             while (true) {
-                std::string data = io.recv_line(1000);
+                if (clock::now() >= end) {
+                    throw std::runtime_error("deadline exceeded");
+                }
+
+                int timeout = line_timeout(cmd, end);
+                std::string data = io.recv_line(timeout);
 
                 if (data == "\u0004") {
                     break;
+                } else if (data.empty()) {
+                    // recv_line gives up with an empty line after the timeout
+                    throw timeout_error("timeout after " + std::to_string(timeout) + " ms");
+                }
+
+                for (char c : data) {
+                    if (static_cast<unsigned char>(c) < 0x20 && c != '\t' && c != '\r') {
+                        throw std::runtime_error("garbled response line");
+                    }
                 }
 
                 response << data << "\n";
@@ -58,13 +222,16 @@ namespace device {
             return response.str();
         }
 
-        void receiveArduinoOutput() {
-
-            while(1) {
-                std::string data = io.recv_line(1000);
-                std::cout << data << std::endl;
-
-                if (data == std::string("\0004")) {
+        // drop whatever is left of a broken response, until the stream
+        // is quiet or a terminator passed by
+        void resync(const std::string &cmd, clock::time_point end) {
+            while (clock::now() < end) {
+                try {
+                    std::string data = io.recv_line(line_timeout(cmd, end));
+                    if (data.empty() || data == "\u0004") {
+                        break;
+                    }
+                } catch (const std::exception &e) {
                     break;
                 }
             }
@@ -0,0 +1,297 @@
+//
+// Sweep planner, warm-up model fitting and persistence
+//
+
+#include "planner.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iterator>
+#include <yaml-cpp/yaml.h>
+
+namespace lpm {
+
+// used until an LED has been seen warming up; the blind second the
+// tools used to wait
+static const double default_settle = 1.0;
+static const double min_settle = 0.1;
+static const double max_settle = 30.0;
+
+// weight of the newest run when updating a learned model
+static const double learn_rate = 0.5;
+
+planner::planner(const std::string &path, double tolerance) : path(path), tol(tolerance) {
+    std::ifstream fin(path);
+    if (!fin.good()) {
+        return;
+    }
+
+    YAML::Node root = YAML::Load(fin);
+    YAML::Node warmup_node = root["warmup"];
+
+    for(YAML::const_iterator it = warmup_node.begin(); it != warmup_node.end(); it++) {
+        uint16_t wavelength = static_cast<uint16_t>(it->first.as<unsigned>());
+
+        for(YAML::const_iterator pt = it->second.begin(); pt != it->second.end(); pt++) {
+            uint16_t pwm = static_cast<uint16_t>(pt->first.as<unsigned>());
+
+            warmup w;
+            w.tau = pt->second["tau"].as<double>();
+            w.amplitude = pt->second["amplitude"].as<double>();
+            w.runs = pt->second["runs"].as<unsigned>();
+
+            model.insert(std::pair<key, warmup>(key(wavelength, pwm), w));
+        }
+    }
+}
+
+// relative power dissipated by an LED: pwm times the photon energy in
+// eV, which is close to the forward voltage
+static double heat_load(const sweep_step &step) {
+    return step.pwm * 1240.0 / std::max<uint16_t>(1, step.wavelength);
+}
+
+std::vector<sweep_step> planner::plan(const std::map<uint8_t, uint16_t> &leds,
+                                      const std::map<uint16_t, uint16_t> &pwm) const {
+    std::vector<sweep_step> steps;
+
+    for(auto elem : leds) {
+        auto p = pwm.find(elem.second);
+
+        sweep_step step;
+        step.pin = elem.first;
+        step.wavelength = elem.second;
+        step.pwm = p != pwm.end() ? p->second : 4096;
+        step.settle = predict(step.wavelength, step.pwm);
+        steps.push_back(step);
+    }
+
+    std::stable_sort(steps.begin(), steps.end(), [](const sweep_step &a, const sweep_step &b) {
+        double load_a = heat_load(a), load_b = heat_load(b);
+        if (load_a != load_b) {
+            return load_a < load_b;
+        }
+        return a.settle < b.settle;
+    });
+
+    return steps;
+}
+
+double planner::predict(uint16_t wavelength, uint16_t pwm) const {
+    auto it = model.lower_bound(key(wavelength, pwm));
+
+    double tau, amplitude;
+    if (it != model.end() && it->first.first == wavelength) {
+        // same or higher pwm, drifts at least as much
+        tau = it->second.tau;
+        amplitude = it->second.amplitude;
+    } else if (it != model.begin() && std::prev(it)->first.first == wavelength) {
+        // only lower pwm values known, the drift grows with the heat load
+        const auto &lower = *std::prev(it);
+        tau = lower.second.tau;
+        amplitude = lower.second.amplitude * pwm / std::max<uint16_t>(1, lower.first.second);
+    } else {
+        return default_settle;
+    }
+
+    if (amplitude <= tol) {
+        return min_settle;
+    }
+
+    double t = tau * std::log(amplitude / tol);
+    return std::min(max_settle, std::max(min_settle, t));
+}
+
+void planner::observe(uint16_t wavelength, double t, double value) {
+    sample s = {t, value};
+    series[wavelength].push_back(s);
+}
+
+bool planner::fit(const std::vector<sample> &s, warmup &w, double &settled_value) const {
+
+    // the rate of change r(t) = D / tau * exp(-t / tau), so log |r| is
+    // linear in t with slope -1 / tau; least squares over the samples
+    double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+    double sign = 0;
+    for (size_t i = 1; i < s.size(); i++) {
+        double dt = s[i].t - s[i - 1].t;
+        double dy = s[i].value - s[i - 1].value;
+        if (dt <= 0 || dy == 0) {
+            continue;
+        }
+
+        double x = (s[i].t + s[i - 1].t) / 2;
+        double y = std::log(std::fabs(dy / dt));
+        n += 1;
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+        sign = dy > 0 ? 1 : -1;
+    }
+
+    double denom = n * sxx - sx * sx;
+    if (n < 2 || denom == 0) {
+        return false;
+    }
+
+    double slope = (n * sxy - sx * sy) / denom;
+    if (slope >= 0) {
+        return false;
+    }
+
+    double tau = -1 / slope;
+
+    // with tau known, every step y(b) - y(a) = D (exp(-a/tau) - exp(-b/tau))
+    // gives D exactly; average in log space. (The intercept of the fit
+    // above is off when the steps are long compared to tau.)
+    double log_drift = 0;
+    for (size_t i = 1; i < s.size(); i++) {
+        double dt = s[i].t - s[i - 1].t;
+        double dy = s[i].value - s[i - 1].value;
+        if (dt <= 0 || dy == 0) {
+            continue;
+        }
+
+        double decay = std::exp(-s[i - 1].t / tau) - std::exp(-s[i].t / tau);
+        log_drift += std::log(std::fabs(dy)) - std::log(decay);
+    }
+
+    double drift = std::exp(log_drift / n);                          // D
+    double remaining = sign * drift * std::exp(-s.back().t / tau);   // y_inf - y(t_last)
+    settled_value = s.back().value + remaining;
+
+    if (settled_value == 0) {
+        return false;
+    }
+
+    w.tau = tau;
+    w.amplitude = drift / std::fabs(settled_value);
+    w.runs = 1;
+    return true;
+}
+
+bool planner::settled(uint16_t wavelength) const {
+    auto it = series.find(wavelength);
+    if (it == series.end() || it->second.size() < 3) {
+        return false;
+    }
+
+    const std::vector<sample> &s = it->second;
+    double last = s.back().value;
+
+    warmup w;
+    double settled_value;
+    if (fit(s, w, settled_value)) {
+        return std::fabs(last - settled_value) / std::fabs(settled_value) <= tol;
+    }
+
+    // no decay to fit: stable if the last samples agree
+    for (size_t i = s.size() - 3; i < s.size(); i++) {
+        if (last == 0 || std::fabs(s[i].value - last) / std::fabs(last) > tol) {
+            return false;
+        }
+    }
+    return true;
+}
+
+double planner::finish(uint16_t wavelength, uint16_t pwm) {
+    std::vector<sample> s = series[wavelength];
+    series.erase(wavelength);
+
+    if (s.size() < 3) {
+        return -1;
+    }
+
+    warmup w;
+    const double final = s.back().value;
+    if (final == 0) {
+        return -1;
+    }
+
+    // stable from the first sample on: any fit would only be fitting
+    // noise. tau is shorter than the time to the first sample and the
+    // drift at most what is left, which predicts the shortest wait.
+    double spread = 0;
+    for (const sample &x : s) {
+        spread = std::max(spread, std::fabs(x.value - final) / std::fabs(final));
+    }
+
+    double actual;
+    double settled_value;
+    if (spread <= tol) {
+        actual = s[0].t;
+        w.tau = s[0].t;
+        w.amplitude = spread;
+        w.runs = 1;
+    } else if (fit(s, w, settled_value)) {
+
+        // relative deviation of each sample from the settled output
+        std::vector<double> dev;
+        for (const sample &x : s) {
+            dev.push_back(std::fabs(x.value - settled_value) / std::fabs(settled_value));
+        }
+
+        // first sample from which on all samples stay within tolerance
+        size_t k = s.size();
+        while (k > 0 && dev[k - 1] <= tol) {
+            k--;
+        }
+
+        if (k == s.size()) {
+            // never got there
+            actual = -1;
+        } else if (k == 0) {
+            actual = s[0].t;
+        } else if (dev[k] > 0) {
+            // the deviation decays exponentially, interpolate its log
+            double f = (std::log(dev[k - 1]) - std::log(tol)) / (std::log(dev[k - 1]) - std::log(dev[k]));
+            actual = s[k - 1].t + f * (s[k].t - s[k - 1].t);
+        } else {
+            actual = s[k].t;
+        }
+    } else {
+        // neither decaying nor stable, nothing to learn from it
+        return -1;
+    }
+
+    auto it = model.find(key(wavelength, pwm));
+    if (it == model.end()) {
+        model.insert(std::pair<key, warmup>(key(wavelength, pwm), w));
+    } else {
+        warmup &m = it->second;
+        m.tau = (1 - learn_rate) * m.tau + learn_rate * w.tau;
+        m.amplitude = (1 - learn_rate) * m.amplitude + learn_rate * w.amplitude;
+        m.runs++;
+    }
+
+    return actual;
+}
+
+void planner::save() const {
+    YAML::Emitter out;
+    out << YAML::BeginMap << YAML::Key << "warmup" << YAML::Value << YAML::BeginMap;
+
+    for(auto it = model.begin(); it != model.end(); ) {
+        uint16_t wavelength = it->first.first;
+        out << YAML::Key << wavelength << YAML::Value << YAML::BeginMap;
+
+        for(; it != model.end() && it->first.first == wavelength; it++) {
+            out << YAML::Key << it->first.second << YAML::Value << YAML::BeginMap;
+            out << YAML::Key << "tau" << YAML::Value << it->second.tau;
+            out << YAML::Key << "amplitude" << YAML::Value << it->second.amplitude;
+            out << YAML::Key << "runs" << YAML::Value << it->second.runs;
+            out << YAML::EndMap;
+        }
+
+        out << YAML::EndMap;
+    }
+
+    out << YAML::EndMap << YAML::EndMap;
+
+    std::ofstream fout(path);
+    fout << out.c_str() << std::endl;
+}
+
+} // lpm::
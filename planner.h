@@ -0,0 +1,100 @@
+//
+// Sweep planner: orders the LEDs of a sweep and predicts how long each
+// one needs to warm up before its output is stable enough to measure.
+//
+// The output of an LED after switching it on is modelled as
+//   y(t) = y_inf - D * exp(-t / tau)
+// tau and the relative drift a = D / y_inf are learned per LED and pwm
+// (wavelength, pwm) from warm-up series of previous runs.
+//
+
+#ifndef LPM_PLANNER_H
+#define LPM_PLANNER_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace lpm {
+
+struct sweep_step {
+    uint8_t  pin;
+    uint16_t wavelength;
+    uint16_t pwm;
+    double   settle;        // predicted warm-up time [s]
+};
+
+class planner {
+public:
+    struct warmup {
+        double tau;         // time constant [s]
+        double amplitude;   // drift relative to the settled output
+        unsigned runs;
+    };
+
+    explicit planner(const std::string &path, double tolerance = 0.01);
+
+    // Order the LEDs by increasing heat load, so that the board only
+    // ever warms up during a sweep and every sweep heats it the same
+    // way as the runs the models were learned from. The heat load is
+    // pwm times the forward voltage, which follows the photon energy
+    // (1240 / wavelength [nm] V): at the same pwm a blue LED dissipates
+    // about twice what a deep red one does. LEDs with the same load
+    // that warm up faster go first.
+    //
+    // The order does not change the predicted settle times: every LED
+    // is switched on from off and the models hold no term for the LED
+    // that ran before, so the predicted total is the same in any order.
+    // leds: pin -> wavelength, pwm: wavelength -> pwm (missing entries
+    // count as full power).
+    std::vector<sweep_step> plan(const std::map<uint8_t, uint16_t> &leds,
+                                 const std::map<uint16_t, uint16_t> &pwm) const;
+
+    // time after switching on until the output is within tolerance [s];
+    // for a pwm without a model of its own, the model of the closest
+    // higher pwm is used, or that of the highest lower pwm with its
+    // drift scaled up by the ratio of the pwm values
+    double predict(uint16_t wavelength, uint16_t pwm) const;
+
+    // record one sample of a warm-up series, t seconds after switching on
+    void observe(uint16_t wavelength, double t, double value);
+
+    // is the last sample of the series within tolerance of the settled
+    // output extrapolated from the series so far; needs at least three
+    // samples, the minimum for a fit
+    bool settled(uint16_t wavelength) const;
+
+    // fit the series of the LED, update its warm-up model at pwm and
+    // return the actual settle time [s], i.e. when the series came
+    // within tolerance of the fitted settled output; -1 if the series
+    // is too short, never got there or can not be fitted. If the output
+    // was already stable at the first sample, that sample's time is
+    // returned (an upper bound) and the LED is predicted the shortest wait.
+    double finish(uint16_t wavelength, uint16_t pwm);
+
+    void save() const;
+
+    double tolerance() const { return tol; }
+
+private:
+    struct sample {
+        double t;
+        double value;
+    };
+
+    // wavelength and pwm
+    typedef std::pair<uint16_t, uint16_t> key;
+
+    // fit the model to a series; false if the series does not decay
+    bool fit(const std::vector<sample> &s, warmup &w, double &settled_value) const;
+
+    std::string path;
+    double tol;
+    std::map<key, warmup> model;
+    std::map<uint16_t, std::vector<sample>> series;
+};
+
+} // lpm::
+
+#endif //LPM_PLANNER_H
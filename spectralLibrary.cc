@@ -0,0 +1,278 @@
+/*
+ * Tool for querying the spectral library that the sweep tools fill;
+ * also has a benchmark mode for ingest, open, flush and lookup latency
+ */
+
+#include <iostream>
+#include <chrono>
+#include <boost/program_options.hpp>
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "library.h"
+
+// Supported commands:
+// latest       (most recent spectrum matching the filter)
+// find         (all spectra matching the filter, as csv)
+// bench N      (ingest N synthetic spectra into a temporary library and time opening, flushing and lookups)
+
+static void
+print_spectra(const std::vector<lpm::spectrum> &spectra)
+{
+    if (spectra.empty()) {
+        return;
+    }
+
+    const lpm::spectrum &first = spectra.front();
+    std::cout << "timestamp,rig,pin,led,pwm,";
+    for (size_t i = 0; i < first.data.size(); i++) {
+        std::cout << first.wl_start + i * first.wl_step;
+
+        if(i != (first.data.size() -1) ) {
+            std::cout << ",";
+        }
+    }
+    std::cout << std::endl;
+
+    for (const lpm::spectrum &s : spectra) {
+        std::cout << s.timestamp << "," << s.rig << "," << unsigned(s.pin) << ","
+                  << s.wavelength << "," << s.pwm << ",";
+
+        for (size_t i = 0; i < s.data.size(); i++) {
+            std::cout << s.data[i];
+
+            if(i != (s.data.size() -1) ) {
+                std::cout << ",";
+            }
+        }
+        std::cout << std::endl;
+    }
+}
+
+static void
+remove_dir(const std::string &path)
+{
+    DIR *dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        return;
+    }
+
+    while (struct dirent *ent = readdir(dir)) {
+        std::string name = ent->d_name;
+        if (name != "." && name != "..") {
+            unlink((path + "/" + name).c_str());
+        }
+    }
+
+    closedir(dir);
+    rmdir(path.c_str());
+}
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double
+elapsed_us(bench_clock::time_point start)
+{
+    return std::chrono::duration<double, std::micro>(bench_clock::now() - start).count();
+}
+
+static lpm::spectrum
+bench_spectrum(size_t i)
+{
+    lpm::spectrum s;
+    s.rig = "bench";
+    s.pin = static_cast<uint8_t>(2 + i % 12);
+    s.wavelength = static_cast<uint16_t>(400 + 10 * (i % 12));
+    s.pwm = static_cast<uint16_t>(1024 * (1 + (i / 12) % 4));
+    s.timestamp = 1000000000 + static_cast<int64_t>(i);
+    s.wl_start = 380;
+    s.wl_step = 4;
+    s.data.assign(101, 0.0f);
+    s.data[0] = i;
+    return s;
+}
+
+static int
+bench(const std::string &path, size_t count)
+{
+    bench_clock::time_point start = bench_clock::now();
+    {
+        lpm::library library(path);
+        for (size_t i = 0; i < count; i++) {
+            library.add(bench_spectrum(i));
+        }
+        library.flush();
+    }
+    double ingest = elapsed_us(start);
+    std::cout << "ingest: " << count << " spectra, " << ingest / count << " us/spectrum" << std::endl;
+
+    /* what every sweep pays: open the library, add a spectrum per LED, flush */
+    const int sweeps = 100;
+    size_t next = count;
+    double open_rw = 0, flush = 0;
+    {
+        start = bench_clock::now();
+        lpm::library library(path);
+        open_rw = elapsed_us(start);
+
+        for (int i = 0; i < sweeps; i++) {
+            for (int led = 0; led < 12; led++) {
+                library.add(bench_spectrum(next++));
+            }
+            start = bench_clock::now();
+            library.flush();
+            flush += elapsed_us(start);
+        }
+    }
+    std::cout << "open: " << open_rw / 1000 << " ms (read-write)" << std::endl;
+    std::cout << "sweep flush: " << flush / sweeps / 1000 << " ms (12 spectra)" << std::endl;
+
+    /* what a CLI query pays: open read only, one lookup */
+    lpm::query q;
+    q.rig = "bench";
+    q.wavelength = 450;
+    q.pwm = 2048;
+    lpm::spectrum out;
+
+    start = bench_clock::now();
+    lpm::library library(path, lpm::library::mode::read_only);
+    library.latest(q, out);
+    double cli = elapsed_us(start);
+    std::cout << "open + latest: " << cli / 1000 << " ms (read only)" << std::endl;
+
+    const int rounds = 1000;
+    start = bench_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        library.latest(q, out);
+    }
+    double latest = elapsed_us(start);
+    std::cout << "latest: " << latest / rounds << " us/query" << std::endl;
+
+    lpm::query range;
+    range.rig = "bench";
+    range.pin = 10;
+    range.from = 1000000000 + static_cast<int64_t>(next) - 30 * 24 * 3600;
+
+    start = bench_clock::now();
+    std::vector<lpm::spectrum> hits = library.find(range);
+    double find = elapsed_us(start);
+    std::cout << "find: " << hits.size() << " spectra in " << find << " us" << std::endl;
+
+    return 0;
+}
+
+// the library is append only, so the synthetic spectra must never go
+// into a real one: bench in a fresh temporary directory and remove it
+static int
+cmd_bench(size_t count)
+{
+    char tmpl[] = "/tmp/lpm-bench-XXXXXX";
+    if (mkdtemp(tmpl) == nullptr) {
+        std::cerr << "[E] Could not create temporary directory" << std::endl;
+        return -1;
+    }
+
+    std::string path = tmpl;
+    std::cerr << "[D] bench library: " << path << std::endl;
+
+    int res;
+    try {
+        res = bench(path, count);
+    } catch (const std::exception &e) {
+        std::cerr << "[E] " << e.what() << std::endl;
+        res = -1;
+    }
+
+    remove_dir(path);
+    return res;
+}
+
+int main(int argc, char **argv) {
+    namespace po = boost::program_options;
+
+    std::string libraryPath = "data/library";
+    std::string input;
+    lpm::query q;
+    int days = 0;
+    size_t count = 1000000;
+
+    po::options_description opts("LED Pseudo Monochromator Spectral Library");
+    opts.add_options()
+            ("help",    "Flag for Help")
+            ("library", po::value<std::string>(&libraryPath), "Spectral library directory (default: data/library)")
+            ("rig", po::value<std::string>(&q.rig), "Only spectra of this rig (at most 16 bytes)")
+            ("pin", po::value<int>(&q.pin), "Only spectra of the LED on this pin")
+            ("led", po::value<int>(&q.wavelength), "Only spectra of the LED with this wavelength")
+            ("pwm", po::value<int>(&q.pwm), "Only spectra measured with this PWM")
+            ("days", po::value<int>(&days), "Only spectra of the last N days")
+            ("input", po::value<std::string>(&input), "Specify command (latest, find, bench)")
+            ("count", po::value<size_t>(&count), "Number of spectra for bench");
+
+    po::positional_options_description pos;
+    pos.add("input", 1).add("count", 1);
+
+    po::variables_map vm;
+
+    try {
+        po::store(po::command_line_parser(argc, argv).options(opts).positional(pos).run(), vm);
+        po::notify(vm);
+    } catch (const std::exception &e) {
+        std::cerr << "Error while parsing commad line options: " << std::endl;
+        std::cerr << "\t" << e.what() << std::endl;
+        return 1;
+    }
+
+    if(vm.count("help")) {
+        std::cout << opts << std::endl;
+        std::cout << "Supported Commands:" << std::endl << std::endl;
+
+        std::cout << "latest       (most recent spectrum matching the filter)" << std::endl;
+        std::cout << "find         (all spectra matching the filter, as csv)" << std::endl;
+        std::cout << "bench N      (ingest N synthetic spectra into a temporary library and time lookups)" << std::endl;
+
+        std::cout << std::endl;
+        return 0;
+    }
+
+    if (input == "bench") {
+        return cmd_bench(count);
+    }
+
+    if (q.rig.size() > lpm::rig_max) {
+        std::cerr << "[E] rig name is longer than " << lpm::rig_max << " bytes" << std::endl;
+        return 1;
+    } else if (vm.count("pin") && (q.pin < 0 || q.pin > UINT8_MAX)) {
+        std::cerr << "[E] pin out of range [0, " << UINT8_MAX << "]" << std::endl;
+        return 1;
+    } else if (vm.count("led") && (q.wavelength < 0 || q.wavelength > UINT16_MAX)) {
+        std::cerr << "[E] led out of range [0, " << UINT16_MAX << "]" << std::endl;
+        return 1;
+    } else if (vm.count("pwm") && (q.pwm < 0 || q.pwm > UINT16_MAX)) {
+        std::cerr << "[E] pwm out of range [0, " << UINT16_MAX << "]" << std::endl;
+        return 1;
+    }
+
+    if (days > 0) {
+        q.from = time(nullptr) - static_cast<int64_t>(days) * 24 * 3600;
+    }
+
+    lpm::library library(libraryPath, lpm::library::mode::read_only);
+
+    if (input == "latest") {
+        lpm::spectrum s;
+        if (!library.latest(q, s)) {
+            std::cerr << "[E] No matching spectrum" << std::endl;
+            return -1;
+        }
+        print_spectra(std::vector<lpm::spectrum>(1, s));
+    } else if (input == "find") {
+        print_spectra(library.find(q));
+    } else {
+        std::cout <<"[E] Unkown command! " << std::endl;
+        return -1;
+    }
+
+    return 0;
+}